@@ -0,0 +1,220 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+long block_size = 0;
+int skip_bad = 0;
+
+/*
+ * Number of erase blocks in the image
+ */
+static long bbt_nb_block(struct image *img)
+{
+	return img->size / raw_page_size() * page_size / block_size;
+}
+
+/*
+ * OOB of a page of an erase block
+ */
+static unsigned char *bbt_oob(struct image *img, long block, int page)
+{
+	return (unsigned char *)img->mem +
+		phys_off(block * block_size + page * page_size) + page_size;
+}
+
+static int bbt_bad(struct image *img, long block)
+{
+	return bbt_oob(img, block, 0)[ecc->bbm_pos] != 0xFF ||
+		bbt_oob(img, block, 1)[ecc->bbm_pos] != 0xFF;
+}
+
+/*
+ * Mark the erase blocks listed in a file as bad, like the factory
+ * does: the bad block marker is cleared in the OOB of the first two
+ * pages of the block.
+ * File format: one block number per line, '#' starts a comment
+ */
+void bbt_mark(struct image *img, const char *filename)
+{
+	char line[128];
+	long block, nb_block, nb = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Can't open bad block file %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	nb_block = bbt_nb_block(img);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%li", &block) != 1)
+			continue;
+		if (block < 0 || block >= nb_block) {
+			fprintf(stderr, "Error: bad block %ld out of flash\n", block);
+			exit(EXIT_FAILURE);
+		}
+		bbt_oob(img, block, 0)[ecc->bbm_pos] = 0x00;
+		bbt_oob(img, block, 1)[ecc->bbm_pos] = 0x00;
+		nb++;
+	}
+	printf("Mark %ld bad blocks\n", nb);
+
+	fclose(fp);
+}
+
+/*
+ * Scan the bad block markers of the image and build, for each
+ * partition, the table of its good blocks: logical block n of a
+ * partition is in physical block map[n].
+ */
+void bbt_scan(struct image *img)
+{
+	long block, first, last, nb_block, nb_bad = 0;
+	int i;
+
+	nb_block = bbt_nb_block(img);
+
+	for (i=0;i<nb_part;i++) {
+		struct partition *part = &part_tab[i];
+
+		if (part->off % block_size || part->len % block_size) {
+			fprintf(stderr, "Error: partition %s not aligned on erase blocks\n",
+					part->name);
+			exit(EXIT_FAILURE);
+		}
+		first = part->off / block_size;
+		last = first + part->len / block_size;
+		if (last > nb_block)
+			last = nb_block;
+
+		free(part->map);
+		part->map = malloc((part->len / block_size + 1) * sizeof(long));
+		if (part->map == NULL) {
+			fprintf(stderr, "Error: malloc\n");
+			exit(EXIT_FAILURE);
+		}
+
+		part->nb_block = 0;
+		for (block=first;block<last;block++) {
+			if (bbt_bad(img, block)) {
+				printf("Bad block %ld in partition %s\n",
+						block, part->name);
+				nb_bad++;
+				continue;
+			}
+			part->map[part->nb_block++] = block;
+		}
+	}
+	printf("%ld bad blocks in partitions\n", nb_bad);
+}
+
+/*
+ * Number of usable pages of a partition
+ */
+long part_nb_page(struct partition *part)
+{
+	if (skip_bad)
+		return part->nb_block * (block_size / page_size);
+	return (part->len + page_size - 1) / page_size;
+}
+
+/*
+ * Offset in the image file of the nth usable page of a partition
+ */
+unsigned long part_page_off(struct partition *part, long n)
+{
+	long ppb;
+
+	if (!skip_bad)
+		return phys_off(part->off + n * page_size);
+
+	ppb = block_size / page_size;
+	return phys_off((part->map[n / ppb] * ppb + n % ppb) * page_size);
+}
+
+/*
+ * Tell if the nth page of a partition is in a bad block. Only the
+ * pages of a NAND with an erase block size, not skipping the bad
+ * blocks, can be.
+ */
+int part_page_bad(struct image *img, struct partition *part, long n)
+{
+	long block;
+
+	if (skip_bad || block_size == 0 || flash_type != FLASH_TYPE_NAND)
+		return 0;
+
+	block = (part->off + n * page_size) / block_size;
+	if (block >= bbt_nb_block(img))
+		return 0;
+
+	return bbt_bad(img, block);
+}
+
+/*
+ * Check that the first nb pages of a partition can be written: like
+ * a real NAND, a bad block can't be programmed without -k.
+ */
+int bbt_check(struct image *img, struct partition *part, long nb)
+{
+	long n;
+
+	for (n=0;n<nb;n++) {
+		if (part_page_bad(img, part, n)) {
+			fprintf(stderr, "Error: bad block %ld in partition %s, "
+					"use -k to skip it\n",
+					(part->off + n * page_size) / block_size,
+					part->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Erase a partition. The bad blocks are left untouched, their
+ * markers can't be erased.
+ */
+void bbt_erase(struct image *img, struct partition *part)
+{
+	long n, nb, len;
+
+	if (skip_bad) {
+		len = block_size / page_size * raw_page_size();
+		for (n=0;n<part->nb_block;n++)
+			memset(img->mem + phys_off(part->map[n] * block_size),
+					0xFF, len);
+		return;
+	}
+
+	nb = part_nb_page(part);
+	for (n=0;n<nb;n++) {
+		if (!part_page_bad(img, part, n))
+			memset(img->mem + part_page_off(part, n), 0xFF,
+					raw_page_size());
+	}
+}
@@ -0,0 +1,318 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Cache of the written partitions across runs. An entry is the page
+ * and OOB stream written for a file, as found in the image, and is
+ * named after a hash of the file content and of the flash geometry.
+ * The hash is not collision resistant: the entry starts with a header
+ * holding the file length and a second hash, both checked on a hit.
+ * The least recently used entries are removed when the cache grows
+ * over its size limit.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+#define CACHE_SUFFIX	".pg"
+#define CACHE_MAGIC	"flashpg1"
+
+struct cache_hdr {
+	char magic[8];
+	struct cache_key key;
+};
+
+char *cache_dir = NULL;
+size_t cache_max = 1024*1024*1024;
+
+static int nb_hit, nb_miss;
+
+struct entry {
+	char name[64];
+	struct timespec mtime;
+	off_t size;
+};
+
+/*
+ * Fast 64 bits hash, processing the data by 64 bits words
+ */
+uint64_t hash64(const unsigned char *p, size_t len, uint64_t seed)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = seed ^ (len * k), w;
+	size_t i = 0;
+
+	for (;;) {
+		w = 0;
+		if (len - i >= 8)
+			memcpy(&w, p + i, 8);
+		else
+			memcpy(&w, p + i, len - i);
+		w *= 0xbf58476d1ce4e5b9ULL;
+		w ^= w >> 31;
+		h = (h ^ w) * k;
+		h ^= h >> 29;
+		i += 8;
+		if (i >= len)
+			break;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void cache_path(char *path, size_t len, const struct cache_key *key)
+{
+	snprintf(path, len, "%s/%016llx" CACHE_SUFFIX, cache_dir,
+			(unsigned long long)key->hash[0]);
+}
+
+/*
+ * Key of a file: two hashes of its content and of the geometry which
+ * gives the OOB of the pages, and its length
+ */
+void cache_key(const char *filename, struct cache_key *key)
+{
+	unsigned char *buf;
+	uint64_t seed;
+	struct stat _stat;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &_stat)) {
+		fprintf(stderr, "Error: can't open file %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	buf = malloc(_stat.st_size + 1);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+	if (read(fd, buf, _stat.st_size) != _stat.st_size) {
+		fprintf(stderr, "Error: can't read file %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	seed = (uint64_t)flash_type << 56 ^ (uint64_t)page_size << 32;
+	if (flash_type == FLASH_TYPE_NAND)
+		seed ^= (uint64_t)ecc->ecc_step << 16 ^ ecc->oob_size;
+	key->hash[0] = hash64(buf, _stat.st_size, seed);
+	key->hash[1] = hash64(buf, _stat.st_size, seed ^ 0x6a09e667f3bcc909ULL);
+	key->len = _stat.st_size;
+
+	free(buf);
+}
+
+/*
+ * Copy the pages of a cache entry to a partition. Return the number
+ * of pages or -1 if the entry is not in the cache.
+ */
+long cache_read(struct image *img, struct partition *part,
+		const struct cache_key *key)
+{
+	char path[PATH_MAX];
+	struct cache_hdr hdr;
+	struct stat _stat;
+	long n, nb;
+	int fd, raw = raw_page_size();
+	ssize_t ret, len;
+
+	cache_path(path, sizeof(path), key);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		nb_miss++;
+		return -1;
+	}
+	fstat(fd, &_stat);
+	len = _stat.st_size - sizeof(hdr);
+	nb = len / raw;
+	if (len < 0 || len % raw || nb > part_nb_page(part) ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.key.hash[0] != key->hash[0] || hdr.key.hash[1] != key->hash[1] ||
+	    hdr.key.len != key->len) {
+		close(fd);
+		nb_miss++;
+		return -1;
+	}
+
+	if (!skip_bad) {
+		ret = read(fd, img->mem + phys_off(part->off), len);
+		if (ret != len)
+			goto err;
+	} else {
+		for (n=0;n<nb;n++) {
+			ret = read(fd, img->mem + part_page_off(part, n), raw);
+			if (ret != raw)
+				goto err;
+		}
+	}
+
+	/* the modification time is the last use of the entry */
+	futimens(fd, NULL);
+	close(fd);
+	nb_hit++;
+
+	return nb;
+
+err:
+	fprintf(stderr, "Error: can't read cache entry %s\n", path);
+	exit(EXIT_FAILURE);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+
+	if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+		return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+	if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+		return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+	return strcmp(ea->name, eb->name);
+}
+
+/*
+ * Remove the least recently used entries, but the one just written,
+ * until the cache fits in its size limit
+ */
+static void cache_evict(const char *keep)
+{
+	char path[PATH_MAX];
+	struct entry *tab = NULL;
+	struct dirent *de;
+	struct stat _stat;
+	size_t total = 0;
+	int i, nb = 0, max = 0;
+	DIR *dir;
+
+	dir = opendir(cache_dir);
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir))) {
+		size_t len = strlen(de->d_name);
+
+		if (len < strlen(CACHE_SUFFIX) || len >= sizeof(tab->name) ||
+		    strcmp(de->d_name + len - strlen(CACHE_SUFFIX), CACHE_SUFFIX))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+		if (stat(path, &_stat))
+			continue;
+		if (nb == max) {
+			max = max ? 2 * max : 64;
+			tab = realloc(tab, max * sizeof(*tab));
+			if (tab == NULL) {
+				fprintf(stderr, "Error: malloc\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		strcpy(tab[nb].name, de->d_name);
+		tab[nb].mtime = _stat.st_mtim;
+		tab[nb].size = _stat.st_size;
+		total += _stat.st_size;
+		nb++;
+	}
+	closedir(dir);
+
+	qsort(tab, nb, sizeof(*tab), entry_cmp);
+	for (i=0;i<nb && total>cache_max;i++) {
+		if (!strcmp(tab[i].name, keep))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache_dir, tab[i].name);
+		if (unlink(path) == 0)
+			printf("Cache: evict %s\n", tab[i].name);
+		total -= tab[i].size;
+	}
+
+	free(tab);
+}
+
+/*
+ * Store the first pages of a partition in the cache. The entry is
+ * written to a temporary file then renamed, so concurrent runs never
+ * see a partial entry.
+ */
+void cache_write(struct image *img, struct partition *part,
+		 const struct cache_key *key, long nb)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	struct cache_hdr hdr;
+	int fd, raw = raw_page_size();
+	long n;
+
+	if (sizeof(hdr) + (size_t)nb * raw > cache_max)
+		return;
+
+	mkdir(cache_dir, 0777);
+	cache_path(path, sizeof(path), key);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Warning: can't create cache entry %s\n", tmp);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.key = *key;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto err;
+	for (n=0;n<nb;n++) {
+		if (write(fd, img->mem + part_page_off(part, n), raw) != raw)
+			goto err;
+	}
+	close(fd);
+
+	if (rename(tmp, path)) {
+		unlink(tmp);
+		return;
+	}
+
+	cache_evict(strrchr(path, '/') + 1);
+	return;
+
+err:
+	fprintf(stderr, "Warning: can't write cache entry %s\n", tmp);
+	close(fd);
+	unlink(tmp);
+}
+
+void cache_report(void)
+{
+	int nb = nb_hit + nb_miss;
+
+	printf("Cache: %d hits, %d misses, hit rate %d%%\n", nb_hit, nb_miss,
+			nb ? nb_hit * 100 / nb : 0);
+}
@@ -0,0 +1,234 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+const char *convert_src = NULL;
+
+/*
+ * Geometry and content of the source image
+ */
+static struct {
+	int type;
+	int page_size;
+	struct ecc_info const *ecc;
+	int raw;
+	unsigned char *mem;
+	size_t size;
+} src;
+
+struct conv {
+	struct image *img;
+	long off;		/* flash offset of the partition */
+	int unit;		/* bytes of data holding whole source and target pages */
+	int corrected;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static unsigned long src_phys_off(unsigned long off)
+{
+	if (src.type == FLASH_TYPE_NAND)
+		return off + (off / src.page_size) * src.ecc->oob_size;
+	return off;
+}
+
+/*
+ * Open the source image
+ * spec: <image>,<type>[,<page size>[,<ecc step>]]
+ */
+int convert_open(const char *spec)
+{
+	char file[256], type[8];
+	int fd, ecc_step = 256;
+	struct stat _stat;
+
+	src.page_size = 0;
+	if (sscanf(spec, "%255[^,],%7[^,],%d,%d", file, type,
+				&src.page_size, &ecc_step) < 2) {
+		fprintf(stderr, "Error: wrong source image %s\n", spec);
+		return -1;
+	}
+
+	if (!strcmp(type, "nand")) {
+		src.type = FLASH_TYPE_NAND;
+		src.ecc = ecc_find(src.page_size, ecc_step);
+		if (src.ecc == NULL) {
+			fprintf(stderr, "Wrong source page size or ECC step\n");
+			return -1;
+		}
+		src.raw = src.page_size + src.ecc->oob_size;
+	} else if (!strcmp(type, "nor")) {
+		src.type = FLASH_TYPE_NOR;
+		src.page_size = src.raw = 4096;
+	} else {
+		fprintf(stderr, "Wrong source flash type %s\n", type);
+		return -1;
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &_stat)) {
+		fprintf(stderr, "Can't open source image %s\n", file);
+		return -1;
+	}
+	src.size = _stat.st_size;
+	if (src.size == 0) {
+		fprintf(stderr, "Error: source image is zero\n");
+		close(fd);
+		return -1;
+	}
+
+	src.mem = mmap(NULL, src.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (src.mem == MAP_FAILED) {
+		fprintf(stderr, "Error: can't map source image %s\n", file);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Size of the flash of the source image, OOB excluded
+ */
+size_t convert_size(void)
+{
+	return src.size / src.raw * src.page_size;
+}
+
+static void convert_units(long first, long last, void *arg)
+{
+	struct conv *c = arg;
+	unsigned char *buf, *p;
+	unsigned long flash;
+	int o, ret, corrected = 0, failed = 0;
+	long u;
+
+	buf = malloc(c->unit);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (u=first;u<last;u++) {
+		flash = c->off + u * c->unit;
+
+		/* strip the source OOB, once the data is corrected */
+		for (o=0;o<c->unit;o+=src.page_size) {
+			p = src.mem + src_phys_off(flash + o);
+			memcpy(buf + o, p, src.page_size);
+			if (src.type != FLASH_TYPE_NAND)
+				continue;
+			ret = oob_correct(src.ecc, buf + o, p + src.page_size);
+			if (ret < 0) {
+				/* undo the steps already corrected */
+				memcpy(buf + o, p, src.page_size);
+				failed++;
+			} else
+				corrected += ret;
+		}
+
+		/* and compute the target one */
+		for (o=0;o<c->unit;o+=page_size) {
+			p = (unsigned char *)c->img->mem + phys_off(flash + o);
+			memcpy(p, buf + o, page_size);
+			if (flash_type == FLASH_TYPE_NAND)
+				oob(buf + o, page_size, p + page_size);
+		}
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->corrected += corrected;
+	c->failed += failed;
+	pthread_mutex_unlock(&c->lock);
+
+	free(buf);
+}
+
+/*
+ * Convert all the partitions of the source image to the geometry
+ * of the target image in one pass. An uncorrectable source page is a
+ * fatal error: the image is not written with a valid ECC over it.
+ */
+void convert(struct image *img)
+{
+	struct conv c;
+	long nb_unit, failed = 0;
+	int i;
+
+	c.img = img;
+	c.unit = src.page_size > page_size ? src.page_size : page_size;
+	pthread_mutex_init(&c.lock, NULL);
+
+	printf("Convert %s image (page %d) to %s image (page %d)\n",
+			src.type == FLASH_TYPE_NAND ? "NAND": "NOR", src.page_size,
+			flash_type == FLASH_TYPE_NAND ? "NAND": "NOR", page_size);
+
+	for (i=0;i<nb_part;i++) {
+		struct partition *part = &part_tab[i];
+
+		nb_unit = (part->len + c.unit - 1) / c.unit;
+		c.off = part->off;
+		c.corrected = c.failed = 0;
+
+		if (part->off % c.unit) {
+			fprintf(stderr, "Error: partition %s not aligned on %d bytes\n",
+					part->name, c.unit);
+			exit(EXIT_FAILURE);
+		}
+		if (src_phys_off(part->off + nb_unit * c.unit) > src.size) {
+			fprintf(stderr, "Error: partition %s out of source image\n",
+					part->name);
+			exit(EXIT_FAILURE);
+		}
+		if (phys_off(part->off + nb_unit * c.unit) > img->size) {
+			fprintf(stderr, "Error: partition %s too big for image\n",
+					part->name);
+			exit(EXIT_FAILURE);
+		}
+
+		parallel_for(nb_unit, convert_units, &c);
+
+		printf("%s\t0x%08lx\t0x%08lx", part->name, part->off, part->len);
+		if (src.type == FLASH_TYPE_NAND)
+			printf("\tECC: %d bits corrected, %d pages uncorrectable",
+					c.corrected, c.failed);
+		putchar('\n');
+		failed += c.failed;
+	}
+
+	pthread_mutex_destroy(&c.lock);
+
+	if (failed) {
+		fprintf(stderr, "Error: %ld uncorrectable pages in source image\n",
+				failed);
+		exit(EXIT_FAILURE);
+	}
+}
@@ -0,0 +1,384 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+#define FAULT_FLIP	0
+#define FAULT_STUCK0	1
+#define FAULT_STUCK1	2
+#define FAULT_ZERO	3
+
+static const char * const fault_name[] = {
+	"flip", "stuck0", "stuck1", "zero",
+};
+
+uint64_t fault_seed = 1;
+const char *fault_report = NULL;
+
+struct fault {
+	long page;
+	int byte;
+	int bit;
+	int type;
+	unsigned char old;
+	unsigned char new;
+};
+
+struct inject {
+	unsigned char *base;	/* first page of the partition in the image */
+	long first_page;	/* flash page number of the first page */
+	long nb_page;
+	int raw;		/* page size in the image, OOB included */
+	int type;
+	int count;		/* faults ... */
+	int pages;		/* ... per group of pages */
+	uint64_t seed;
+	struct fault *tab;	/* count entries per group, or NULL */
+};
+
+/*
+ * splitmix64: small, fast and good enough to spread the faults.
+ * The state is derived from the seed and the page number so the
+ * faults only depend on the seed, not on the number of threads.
+ */
+static uint64_t fault_rand(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void inject_groups(long first, long last, void *arg)
+{
+	struct inject *inj = arg;
+	struct fault f;
+	unsigned char *p;
+	uint64_t state;
+	long g, span;
+	int k;
+
+	for (g=first;g<last;g++) {
+		state = inj->seed ^ ((uint64_t)(inj->first_page + g * inj->pages)
+						* 0xd1b54a32d192ed03ULL);
+		span = inj->nb_page - g * inj->pages;
+		if (span > inj->pages)
+			span = inj->pages;
+
+		for (k=0;k<inj->count;k++) {
+			f.page = g * inj->pages + fault_rand(&state) % span;
+			f.byte = fault_rand(&state) % inj->raw;
+			f.bit = fault_rand(&state) % 8;
+			f.type = inj->type;
+			p = inj->base + f.page * inj->raw;
+
+			f.old = p[f.byte];
+			switch (f.type) {
+				case FAULT_FLIP:
+					p[f.byte] ^= 1 << f.bit;
+					break;
+				case FAULT_STUCK0:
+					p[f.byte] &= ~(1 << f.bit);
+					break;
+				case FAULT_STUCK1:
+					p[f.byte] |= 1 << f.bit;
+					break;
+				case FAULT_ZERO:
+					memset(p, 0x00, inj->raw);
+					break;
+			}
+			f.new = p[f.byte];
+			f.page += inj->first_page;
+
+			if (inj->tab)
+				inj->tab[g * inj->count + k] = f;
+		}
+	}
+}
+
+static int inject_setup(struct inject *inj, struct image *img,
+			const char *part_name)
+{
+	struct partition *part;
+	unsigned long off;
+
+	part = partition_find(part_name);
+	if (part == NULL) {
+		fprintf(stderr, "Error: unknown partition %s\n", part_name);
+		return -1;
+	}
+
+	memset(inj, 0, sizeof(*inj));
+	inj->raw = raw_page_size();
+	inj->nb_page = (part->len + page_size - 1) / page_size;
+	inj->first_page = part->off / page_size;
+	off = phys_off(part->off);
+	if (off + inj->nb_page * inj->raw > img->size) {
+		fprintf(stderr, "Error: image file too small\n");
+		return -1;
+	}
+	inj->base = (unsigned char *)img->mem + off;
+	inj->seed = fault_seed;
+
+	return 0;
+}
+
+static void report_write(struct inject *inj, const char *part_name, long nb)
+{
+	static int append = 0;
+	FILE *fp;
+	long i;
+
+	fp = fopen(fault_report, append ? "a" : "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Can't open report file %s\n", fault_report);
+		exit(EXIT_FAILURE);
+	}
+	if (!append)
+		fprintf(fp, "# seed=0x%llx page_size=%d oob_size=%d\n"
+			    "# partition page byte bit fault old new\n",
+			(unsigned long long)fault_seed, page_size,
+			inj->raw - page_size);
+	append = 1;
+
+	for (i=0;i<nb;i++) {
+		struct fault *f = &inj->tab[i];
+
+		if (f->type == FAULT_ZERO)
+			fprintf(fp, "%s %ld - - zero - -\n", part_name, f->page);
+		else
+			fprintf(fp, "%s %ld %d %d %s 0x%02x 0x%02x\n",
+				part_name, f->page, f->byte, f->bit,
+				fault_name[f->type], f->old, f->new);
+	}
+
+	fclose(fp);
+}
+
+/*
+ * Inject faults in a partition
+ * spec: <fault>[,<count>[,<pages>]]
+ */
+void fault_inject(struct image *img, const char *part_name, const char *spec)
+{
+	struct inject inj;
+	char name[16];
+	long nb_group;
+	int i, count = 1, pages = 1;
+
+	if (inject_setup(&inj, img, part_name))
+		exit(EXIT_FAILURE);
+
+	if (sscanf(spec, "%15[^,],%d,%d", name, &count, &pages) < 1 ||
+	    count < 0 || pages < 1) {
+		fprintf(stderr, "Error: wrong fault %s\n", spec);
+		exit(EXIT_FAILURE);
+	}
+	for (i=0;i<4;i++) {
+		if (!strcmp(fault_name[i], name))
+			break;
+	}
+	if (i == 4) {
+		fprintf(stderr, "Error: unknown fault %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+	inj.type = i;
+	inj.count = count;
+	inj.pages = pages;
+
+	nb_group = (inj.nb_page + pages - 1) / pages;
+	inj.tab = malloc(nb_group * count * sizeof(struct fault) + 1);
+	if (inj.tab == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Inject %ld %s faults in partition %s (seed 0x%llx)\n",
+			nb_group * count, name, part_name,
+			(unsigned long long)fault_seed);
+	parallel_for(nb_group, inject_groups, &inj);
+
+	if (fault_report)
+		report_write(&inj, part_name, nb_group * count);
+
+	free(inj.tab);
+}
+
+struct bench {
+	unsigned char *base;
+	long nb_page;
+	int raw;
+	int *result;
+};
+
+static void bench_correct(long first, long last, void *arg)
+{
+	struct bench *b = arg;
+	long i;
+
+	for (i=first;i<last;i++) {
+		unsigned char *p = b->base + i * b->raw;
+
+		b->result[i] = oob_correct(ecc, p, p + page_size);
+	}
+}
+
+/*
+ * Correct the pages of the reference copy and give them a new OOB, so
+ * the benchmark starts from ECC clean pages
+ */
+static void bench_clean(long first, long last, void *arg)
+{
+	struct bench *b = arg;
+	long i;
+
+	for (i=first;i<last;i++) {
+		unsigned char *p = b->base + i * b->raw;
+
+		b->result[i] = oob_correct(ecc, p, p + page_size);
+		if (b->result[i] >= 0)
+			oob(p, page_size, p + page_size);
+	}
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Benchmark the ECC correction path of a partition for several
+ * error densities. The partition is left untouched: its pages, once
+ * corrected, are the reference the corrected copies are checked against.
+ * args: [<rounds>]
+ */
+void fault_bench(struct image *img, const char *part_name, const char *args)
+{
+	static const struct {
+		int count;
+		int pages;
+	} density[] = {
+		{ 0, 1 }, { 1, 64 }, { 1, 16 }, { 1, 4 },
+		{ 1, 1 }, { 2, 1 }, { 4, 1 }, { 8, 1 },
+	};
+	struct inject inj;
+	struct bench b, clean;
+	struct timespec start;
+	unsigned char *pristine;
+	size_t len;
+	long i, corrected, failed, wrong;
+	int d, r, rounds = 4;
+	double t;
+
+	if (flash_type != FLASH_TYPE_NAND) {
+		fprintf(stderr, "Error: ECC benchmark needs a NAND flash\n");
+		exit(EXIT_FAILURE);
+	}
+	if (inject_setup(&inj, img, part_name))
+		exit(EXIT_FAILURE);
+	if (*args)
+		rounds = atoi(args);
+	if (rounds < 1)
+		rounds = 1;
+
+	len = inj.nb_page * inj.raw;
+	pristine = malloc(len);
+	b.base = malloc(len);
+	b.result = malloc(inj.nb_page * sizeof(int));
+	if (pristine == NULL || b.base == NULL || b.result == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(pristine, inj.base, len);
+	b.nb_page = inj.nb_page;
+	b.raw = inj.raw;
+
+	clean = b;
+	clean.base = pristine;
+	parallel_for(inj.nb_page, bench_clean, &clean);
+	corrected = failed = 0;
+	for (i=0;i<inj.nb_page;i++) {
+		if (b.result[i] < 0)
+			failed++;
+		else
+			corrected += b.result[i];
+	}
+	if (failed) {
+		fprintf(stderr, "Error: %ld uncorrectable pages in partition %s\n",
+				failed, part_name);
+		exit(EXIT_FAILURE);
+	}
+	if (corrected)
+		printf("%ld bits corrected in partition %s before the benchmark\n",
+				corrected, part_name);
+
+	printf("ECC benchmark on %s: %ld pages, %d rounds, %d threads\n",
+			part_name, inj.nb_page, rounds, nb_threads);
+	printf("flips/page\tcorrected\tuncorrectable\tmiscorrected\tMB/s\n");
+
+	inj.base = b.base;
+	inj.type = FAULT_FLIP;
+	for (d=0;d<sizeof(density)/sizeof(density[0]);d++) {
+		inj.count = density[d].count;
+		inj.pages = density[d].pages;
+		corrected = failed = wrong = 0;
+		t = 0;
+
+		for (r=0;r<rounds;r++) {
+			memcpy(b.base, pristine, len);
+			inj.seed = fault_seed + r;
+			parallel_for((inj.nb_page + inj.pages - 1) / inj.pages,
+					inject_groups, &inj);
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			parallel_for(inj.nb_page, bench_correct, &b);
+			t += elapsed(&start);
+
+			for (i=0;i<inj.nb_page;i++) {
+				if (b.result[i] < 0) {
+					failed++;
+					continue;
+				}
+				corrected += b.result[i];
+				if (memcmp(b.base + i * inj.raw,
+					   pristine + i * inj.raw, page_size))
+					wrong++;
+			}
+		}
+
+		printf("%.4f\t\t%ld\t\t%ld\t\t%ld\t\t%.1f\n",
+			(double)inj.count / inj.pages, corrected, failed, wrong,
+			(double)inj.nb_page * page_size * rounds / t / 1e6);
+	}
+
+	free(b.result);
+	free(b.base);
+	free(pristine);
+}
@@ -0,0 +1,143 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef FLASHIMG_H
+#define FLASHIMG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLASH_TYPE_NAND	0
+#define FLASH_TYPE_NOR	1
+
+struct image {
+	char *mem;
+	size_t size;
+};
+
+struct action {
+	char *part;
+	char *file;
+	char action;
+};
+
+struct ecc_info {
+	int page_size;
+	int ecc_step;		/* data bytes per 3 ECC bytes: 256 or 512 */
+	int oob_size;
+	int bbm_pos;		/* bad block marker in the OOB */
+	int ecc_nb;
+	int ecc_pos[24];
+};
+
+struct partition {
+	char *name;
+	long off;
+	long len;
+	long *map;		/* good erase blocks, when skipping bad blocks */
+	long nb_block;
+};
+
+extern struct ecc_info const *ecc;
+extern int page_size;
+extern struct partition part_tab[32];
+extern int nb_part;
+extern int flash_type;
+extern int nb_threads;
+extern long block_size;
+extern int skip_bad;
+
+/* main.c */
+struct partition *partition_find(const char *part_name);
+unsigned long phys_off(unsigned long off);
+int raw_page_size(void);
+size_t parse_size(const char *arg);
+void oob(const unsigned char *buf, size_t len, unsigned char *check);
+int oob_correct(struct ecc_info const *ecc, unsigned char *buf,
+		const unsigned char *check);
+struct ecc_info const *ecc_find(int page_size, int ecc_step);
+
+/* nand_ecc.c */
+void __nand_calculate_ecc(const unsigned char *buf, unsigned int eccsize,
+		       unsigned char *code);
+int __nand_correct_data(unsigned char *buf,
+			unsigned char *read_ecc, unsigned char *calc_ecc,
+			unsigned int eccsize);
+
+/* thread.c */
+void parallel_for(long nb, void (*fn)(long first, long last, void *arg),
+		  void *arg);
+
+/* fault.c */
+void fault_inject(struct image *img, const char *part_name, const char *spec);
+void fault_bench(struct image *img, const char *part_name, const char *args);
+extern uint64_t fault_seed;
+extern const char *fault_report;
+
+/* lock.c */
+int image_map(const char *filename, struct image *img, size_t size);
+void image_lock(int fd, const char *part_name, int write);
+void image_unlock(int fd, struct image *img, const char *part_name);
+
+/* bbt.c */
+void bbt_mark(struct image *img, const char *filename);
+void bbt_scan(struct image *img);
+void bbt_erase(struct image *img, struct partition *part);
+int bbt_check(struct image *img, struct partition *part, long nb);
+int part_page_bad(struct image *img, struct partition *part, long n);
+long part_nb_page(struct partition *part);
+unsigned long part_page_off(struct partition *part, long n);
+
+/* watch.c */
+void watch(int fd_img, struct image *img, struct action *act_tab, int nb_act);
+
+/* ubi.c */
+void ubi_write(struct image *img, const char *part_name, const char *filename);
+
+/* cache.c */
+uint64_t hash64(const unsigned char *p, size_t len, uint64_t seed);
+struct cache_key {
+	uint64_t hash[2];	/* hash[0] names the entry */
+	uint64_t len;		/* of the file */
+};
+
+void cache_key(const char *filename, struct cache_key *key);
+long cache_read(struct image *img, struct partition *part,
+		const struct cache_key *key);
+void cache_write(struct image *img, struct partition *part,
+		 const struct cache_key *key, long nb);
+void cache_report(void);
+extern char *cache_dir;
+extern size_t cache_max;
+
+/* store.c */
+int store_open(const char *spec, struct image *img);
+void store_fetch(const char *part_name, int erase);
+void store_fetch_all(void);
+void store_add(const char *spec, struct image *img);
+extern const char *store_src;
+extern const char *store_dst;
+
+/* convert.c */
+int convert_open(const char *spec);
+size_t convert_size(void);
+void convert(struct image *img);
+extern const char *convert_src;
+
+#endif /* FLASHIMG_H */
@@ -0,0 +1,159 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+/*
+ * Open file description locks belong to the open file, not to the
+ * process, and are released with it: several flashimg can update
+ * distinct partitions of one image at the same time.
+ */
+static void range_lock(int fd, off_t start, off_t len, short type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+
+	if (fcntl(fd, F_OFD_SETLKW, &fl) < 0) {
+		perror("Error: can't lock image file");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Range of the image file holding a partition, OOB included
+ */
+static int partition_range(const char *part_name, off_t *start, off_t *len)
+{
+	struct partition *part;
+
+	part = partition_find(part_name);
+	if (part == NULL)
+		return -1;
+
+	*start = phys_off(part->off);
+	*len = (off_t)((part->len + page_size - 1) / page_size) * raw_page_size();
+
+	return 0;
+}
+
+/*
+ * Map the image file in place. size is the wanted size of the image,
+ * OOB included, or 0 to keep the size of the file. The file is
+ * extended with erased pages under a lock of the range added only.
+ * Return the file descriptor.
+ */
+int image_map(const char *filename, struct image *img, size_t size)
+{
+	static char erased[4096];
+	struct stat _stat;
+	size_t n;
+	off_t start, end;
+	int fd;
+
+	fd = open(filename, O_CREAT | O_RDWR, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open image file %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	fstat(fd, &_stat);
+	end = _stat.st_size;
+	if (end < (off_t)size) {
+		/* another run may extend the file while we wait for the lock */
+		range_lock(fd, end, size - end, F_WRLCK);
+		fstat(fd, &_stat);
+		start = end;
+		end = _stat.st_size;
+		if (end < (off_t)size) {
+			printf("Extend image file to %zd bytes\n", size);
+			memset(erased, 0xFF, sizeof(erased));
+		}
+		while (end < (off_t)size) {
+			n = size - end;
+			if (n > sizeof(erased))
+				n = sizeof(erased);
+			if (pwrite(fd, erased, n, end) != n) {
+				perror("Error: can't extend image file");
+				exit(EXIT_FAILURE);
+			}
+			end += n;
+		}
+		range_lock(fd, start, size - start, F_UNLCK);
+	}
+
+	img->size = end;
+	if (img->size == 0) {
+		fprintf(stderr, "Error: image file is zero\n");
+		exit(EXIT_FAILURE);
+	}
+
+	img->mem = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (img->mem == MAP_FAILED) {
+		perror("Error: can't map image file");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+void image_lock(int fd, const char *part_name, int write)
+{
+	off_t start, len;
+
+	if (partition_range(part_name, &start, &len))
+		return;
+
+	printf("Lock 0x%lx bytes @0x%lx for %s\n", (long)len, (long)start,
+			write ? "writing" : "reading");
+	range_lock(fd, start, len, write ? F_WRLCK : F_RDLCK);
+}
+
+/*
+ * Flush the partition to the file before releasing it
+ */
+void image_unlock(int fd, struct image *img, const char *part_name)
+{
+	off_t start, len, align, sync;
+
+	if (partition_range(part_name, &start, &len))
+		return;
+
+	align = start % sysconf(_SC_PAGESIZE);
+	sync = len;
+	if (start + sync > img->size)
+		sync = img->size - start;
+	if (sync > 0)
+		msync(img->mem + start - align, sync + align, MS_SYNC);
+	range_lock(fd, start, len, F_UNLCK);
+}
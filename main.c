@@ -23,87 +23,82 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <getopt.h>
 
 #include "config.h"
-
-#define FLASH_TYPE_NAND	0
-#define FLASH_TYPE_NOR	1
-
-
-struct image {
-	char *mem;
-	size_t size;
-};
-
-struct action {
-	char *part;
-	char *file;
-	char action;
-};
-
-struct ecc_info {
-	int page_size;
-	int oob_size;
-	int ecc_nb;
-	int ecc_pos[24];
-};
+#include "flashimg.h"
 
 struct ecc_info const ecc_tab[] = {
 	{
 	.page_size = 256,
+	.ecc_step = 256,
 	.oob_size = 8,
+	.bbm_pos = 5,
 	.ecc_nb = 3,
 	.ecc_pos = { 0, 1, 2 },
 	},
 
 	{
 	.page_size = 512,
+	.ecc_step = 256,
 	.oob_size = 16,
+	.bbm_pos = 5,
 	.ecc_nb = 6,
 	.ecc_pos = { 0, 1, 2, 3, 6, 7 },
 	},
 
+	{
+	.page_size = 512,
+	.ecc_step = 512,
+	.oob_size = 16,
+	.bbm_pos = 5,
+	.ecc_nb = 3,
+	.ecc_pos = { 0, 1, 2 },
+	},
+
 	{
 	.page_size = 2048,
+	.ecc_step = 256,
 	.oob_size = 64,
+	.bbm_pos = 0,
 	.ecc_nb = 24,
 	.ecc_pos = {
 		40, 41, 42, 43, 44, 45, 46, 47,
 		48, 49, 50, 51, 52, 53, 54, 55,
 		56, 57, 58, 59, 60, 61, 62, 63 },
 	},
-};
 
-
-struct partition {
-	char *name;
-	long off;
-	long len;
+	{
+	.page_size = 2048,
+	.ecc_step = 512,
+	.oob_size = 64,
+	.bbm_pos = 0,
+	.ecc_nb = 12,
+	.ecc_pos = {
+		52, 53, 54, 55, 56, 57, 58, 59,
+		60, 61, 62, 63 },
+	},
 };
 
-static struct ecc_info const *ecc = NULL;
-static int page_size;
-static struct partition part_tab[32];
-static int nb_part;
-static int flash_type;
-
-void __nand_calculate_ecc(const unsigned char *buf, unsigned int eccsize,
-		       unsigned char *code);
+struct ecc_info const *ecc = NULL;
+int page_size;
+struct partition part_tab[32];
+int nb_part;
+int flash_type;
+static int ecc_read;
 
-static void oob(const unsigned char *buf, size_t len, unsigned char *check)
+void oob(const unsigned char *buf, size_t len, unsigned char *check)
 {
 	int i;
 	unsigned char code[32], *_code;
 
-	memset(check, 0xff, 16);
+	memset(check, 0xff, ecc->oob_size);
 
 	_code = code;
-	for (i=0;i<len/256;i++) {
-		__nand_calculate_ecc(buf+i*256, 256, _code);
-		check[0] = _code[0];
-		check[1] = _code[1];
-		check[2] = _code[2];
+	for (i=0;i<len/ecc->ecc_step;i++) {
+		__nand_calculate_ecc(buf+i*ecc->ecc_step, ecc->ecc_step, _code);
 		_code += 3;
 	}
 
@@ -111,6 +106,78 @@ static void oob(const unsigned char *buf, size_t len, unsigned char *check)
 		check[ecc->ecc_pos[i]] = code[i];
 }
 
+/*
+ * Check a page against the ECC stored in its OOB and repair it.
+ * Return the number of corrected bits or -1 if the page is
+ * uncorrectable.
+ */
+int oob_correct(struct ecc_info const *ecc, unsigned char *buf,
+		const unsigned char *check)
+{
+	int i, j, ret, nb = 0, bad = 0;
+	unsigned char code[3], read_ecc[3];
+
+	for (i=0;i<ecc->ecc_nb/3;i++) {
+		__nand_calculate_ecc(buf+i*ecc->ecc_step, ecc->ecc_step, code);
+		for (j=0;j<3;j++)
+			read_ecc[j] = check[ecc->ecc_pos[i*3+j]];
+		ret = __nand_correct_data(buf+i*ecc->ecc_step, read_ecc, code,
+					  ecc->ecc_step);
+		if (ret < 0)
+			bad = 1;
+		else
+			nb += ret;
+	}
+
+	return bad ? -1 : nb;
+}
+
+struct ecc_info const *ecc_find(int page_size, int ecc_step)
+{
+	int i;
+
+	for(i=0;i<sizeof(ecc_tab)/sizeof(ecc_tab[0]);i++) {
+		if (ecc_tab[i].page_size == page_size &&
+		    ecc_tab[i].ecc_step == ecc_step)
+			return &ecc_tab[i];
+	}
+
+	return NULL;
+}
+
+struct partition *partition_find(const char *part_name)
+{
+	int i;
+
+	for (i=0;i<nb_part;i++) {
+		if (!strcmp(part_tab[i].name, part_name))
+			return &part_tab[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Offset in the image file of a flash offset (NAND pages are followed
+ * by their OOB area)
+ */
+unsigned long phys_off(unsigned long off)
+{
+	if (flash_type == FLASH_TYPE_NAND)
+		return off + (off / ecc->page_size) * ecc->oob_size;
+	return off;
+}
+
+/*
+ * Size of a page in the image file, OOB included
+ */
+int raw_page_size(void)
+{
+	if (flash_type == FLASH_TYPE_NAND)
+		return page_size + ecc->oob_size;
+	return page_size;
+}
+
 /*
  * Parse the partition file
  */
@@ -156,32 +223,30 @@ static int partition_file(const char *filename)
 }
 
 /*
- * Read data from image file
+ * Read data from image file. With ecc_read, NAND pages are checked and
+ * corrected with the ECC of their OOB; the uncorrectable ones are
+ * written as read. Return -1 if a page is uncorrectable.
  */
-static void partition_read(struct image *img, const char *part_name, const char *filename)
+static int partition_read(struct image *img, const char *part_name, const char *filename)
 {
-	char *buf;
-	int i, nb_page, pages;
+	unsigned char *buf;
+	int pages, ret, n;
+	int corrected = 0, failed = 0;
 	FILE *fp;
 	unsigned long off;
+	struct partition *part;
+	char *mem;
+
+	part = partition_find(part_name);
+	if (part == NULL) return 0;
 
 	buf = malloc(page_size);
-	for (i=0;i<nb_part;i++) {
-		if (!strcmp(part_tab[i].name, part_name)) {
-			break;
-		}
-	}
-	if (i == nb_part) return;
 
 	printf("Partion %s found (0x%lx bytes @0x%lx)\n",
-			part_name, part_tab[i].len, part_tab[i].off);
+			part_name, part->len, part->off);
 
-	if (flash_type == FLASH_TYPE_NAND)
-		off = part_tab[i].off + (part_tab[i].off / ecc->page_size) * ecc->oob_size;
-	else
-		off = part_tab[i].off;
+	off = phys_off(part->off);
 	printf("off real=%lx\n", off);
-	img->mem += off;
 
 	printf("Read partition:\n");
 	fp = fopen(filename, "wb");
@@ -190,18 +255,38 @@ static void partition_read(struct image *img, const char *part_name, const char
 		exit(EXIT_FAILURE);
 	}
 
-	pages = nb_page = (part_tab[i].len + page_size - 1) / ecc->page_size;
-
-	while (nb_page--) {
-		memcpy(buf, img->mem, page_size);
+	pages = part_nb_page(part);
+
+	for (n=0;n<pages;n++) {
+		mem = img->mem + part_page_off(part, n);
+		memcpy(buf, mem, page_size);
+		if (flash_type == FLASH_TYPE_NAND && ecc_read) {
+			ret = oob_correct(ecc, buf,
+					  (unsigned char *)mem + page_size);
+			if (ret < 0) {
+				/* undo the steps already corrected */
+				memcpy(buf, mem, page_size);
+				failed++;
+			} else
+				corrected += ret;
+		}
 		fwrite(buf, 1, page_size, fp);
-		img->mem += page_size;
-		if (flash_type == FLASH_TYPE_NAND)
-			img->mem += ecc->oob_size;
 	}
-	printf("Read %d blocks at %ld\n", pages-nb_page, part_tab[i].off);
+	printf("Read %d blocks at %ld\n", pages, part->off);
+	if (flash_type == FLASH_TYPE_NAND && ecc_read)
+		printf("ECC: %d bits corrected, %d pages uncorrectable\n",
+				corrected, failed);
 
 	fclose(fp);
+	free(buf);
+
+	if (failed) {
+		fprintf(stderr, "Error: %d uncorrectable pages in partition %s\n",
+				failed, part_name);
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
@@ -211,32 +296,27 @@ static void partition_write(struct image *img, const char *part_name, const char
 {
 	unsigned char *buf;
 	unsigned char oob_buf[64];
-	int i, nb_page, ret, pages;
+	int nb_page, ret, pages;
 	FILE *fp;
 	unsigned long off;
 	size_t part_len;
 	struct stat _stat;
+	struct partition *part;
+	struct cache_key key;
+	long cached;
+
+	part = partition_find(part_name);
+	if (part == NULL) return;
 
 	buf = malloc(page_size);
-	for(i=0;i<nb_part;i++) {
-		if (!strcmp(part_tab[i].name, part_name)) {
-			break;
-		}
-	}
-	if (i==nb_part) return;
 
 	printf("Partition %s found (0x%lx bytes @0x%lx)\n",
-			part_name, part_tab[i].len, part_tab[i].off);
+			part_name, part->len, part->off);
 
-	pages = nb_page = (part_tab[i].len + page_size - 1) / page_size;
+	pages = nb_page = part_nb_page(part);
 
-	if (flash_type == FLASH_TYPE_NAND) {
-		off = part_tab[i].off + (part_tab[i].off / ecc->page_size) * ecc->oob_size;
-		part_len = nb_page * (page_size + ecc->oob_size);
-	} else {
-		off = part_tab[i].off;
-		part_len = nb_page * page_size;
-	}
+	off = phys_off(part->off);
+	part_len = (part->len + page_size - 1) / page_size * raw_page_size();
 	printf("off real=%lx\n", off);
 
 	if (img->size < off) {
@@ -250,13 +330,26 @@ static void partition_write(struct image *img, const char *part_name, const char
 
 	ret = stat(filename, &_stat);
 	printf("  st_size=%zd part_len=%zd\n", _stat.st_size, part_len);
-	if (_stat.st_size > part_len) {
+	if (_stat.st_size > (off_t)pages * page_size) {
 		fprintf(stderr, "Error: file too big\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if (bbt_check(img, part, (_stat.st_size + page_size - 1) / page_size))
+		exit(EXIT_FAILURE);
+
 	printf("Erase partition\n");
-	memset(img->mem + off, 0xFF, part_len);
+	bbt_erase(img, part);
+
+	if (cache_dir) {
+		cache_key(filename, &key);
+		cached = cache_read(img, part, &key);
+		if (cached >= 0) {
+			printf("Write %ld blocks at %ld from cache\n", cached, part->off);
+			free(buf);
+			return;
+		}
+	}
 
 	printf("Write partition:\n");
 	fp = fopen(filename, "rb");
@@ -270,26 +363,58 @@ static void partition_write(struct image *img, const char *part_name, const char
 		ret = fread(buf, 1, page_size, fp);
 		if (ret <= 0) break;
 
+		if (nb_page == 0) {
+			fprintf(stderr, "File %s to big for the partition %s\n",
+						filename, part->name);
+			exit(EXIT_FAILURE);
+		}
+		off = part_page_off(part, pages - nb_page);
+
 		memcpy(img->mem + off, buf, page_size);
 		off += page_size;
 
 		if (flash_type == FLASH_TYPE_NAND) {
 			oob(buf, ecc->page_size, oob_buf);
 			memcpy(img->mem + off, oob_buf, ecc->oob_size);
-			off += ecc->oob_size;
 		}
 
-		if (ret != page_size) break;
 		nb_page--;
-		if (nb_page == -1) {
-			fprintf(stderr, "File %s to big for the partition %s\n",
-						filename, part_tab[i].name);
-			exit(EXIT_FAILURE);
-		}
+		if (ret != page_size) break;
 	}
-	printf("Write %d blocks at %ld\n", pages-nb_page, part_tab[i].off);
+	printf("Write %d blocks at %ld\n", pages-nb_page, part->off);
+	if (cache_dir)
+		cache_write(img, part, &key, pages-nb_page);
 
 	fclose(fp);
+	free(buf);
+}
+
+/*
+ * Parse a size with an optional K, M or G suffix (KiB, MiB and GiB
+ * are accepted too)
+ */
+size_t parse_size(const char *arg)
+{
+	size_t size;
+	char *end;
+
+	size = strtoul(arg, &end, 0);
+	switch (*end) {
+		case 'K':
+		case 'k':
+			size *= 1024;
+			break;
+		case 'M':
+		case 'm':
+			size *= 1024*1024;
+			break;
+		case 'G':
+		case 'g':
+			size *= 1024*1024*1024;
+			break;
+	}
+
+	return size;
 }
 
 static void usage(const char *name)
@@ -304,6 +429,30 @@ static void usage(const char *name)
 	printf("\t-t <type>             flash type: nand or nor\n");
 	printf("\t-z <page size>        page size of the NAND flash\n");
 	printf("\t                      valid values are 256, 512 and 2048\n");
+	printf("\t-e <ecc step>         data bytes per ECC step: 256 (default) or 512\n");
+	printf("\t-E                    correct the data read with the ECC of the OOB\n");
+	printf("\t-F <partition>,<fault>[,<count>[,<pages>]]\n");
+	printf("\t                      inject faults in a partition: flip, stuck0,\n");
+	printf("\t                      stuck1 or zero, <count> per <pages> pages\n");
+	printf("\t-B <partition>[,<rounds>]\n");
+	printf("\t                      benchmark ECC correction against error density\n");
+	printf("\t-S <seed>             seed of the fault generator\n");
+	printf("\t-R <file>             write the fault ground truth report to file\n");
+	printf("\t-j <threads>          number of threads\n");
+	printf("\t-C <image>,<type>[,<page size>[,<ecc step>]]\n");
+	printf("\t                      convert the partitions of a source image\n");
+	printf("\t-L                    update the image in place, locking only\n");
+	printf("\t                      the partitions read or written\n");
+	printf("\t-b <size>             erase block size of the flash\n");
+	printf("\t-m <file>             mark the erase blocks listed in file as bad\n");
+	printf("\t-k                    skip bad blocks when reading or writing\n");
+	printf("\t-U <partition>,<file> write an UBI image of the volumes defined\n");
+	printf("\t                      in file (ubinize ini format) to a partition\n");
+	printf("\t-c <dir>[,<max size>] cache the written partitions in dir\n");
+	printf("\t-X <store>,<name>     open an image of a page store\n");
+	printf("\t-A <store>,<name>     add the image to a page store\n");
+	printf("\t-W, --watch           keep running and update the partitions\n");
+	printf("\t                      each time their -w file changes\n");
 }
 
 int main(int argc, char *argv[])
@@ -317,11 +466,24 @@ int main(int argc, char *argv[])
 	struct action act_tab[32];
 	int nb_act;
 	int err = 0;
+	int status = EXIT_SUCCESS;
+	int ecc_step = 256;
+	int in_place = 0;
+	int watch_mode = 0;
+	static const struct option long_opts[] = {
+		{ "watch", no_argument, NULL, 'W' },
+		{ NULL, 0, NULL, 0 },
+	};
+	char *bbt_file = NULL;
 
 	nb_act = 0;
 	img.size = 0;
+	nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nb_threads < 1)
+		nb_threads = 1;
 
-	while ((opt = getopt(argc, argv, "vs:f:p:w:r:t:z:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "vs:f:p:w:r:t:z:e:EF:B:S:R:j:C:Lb:m:kWU:c:X:A:",
+				  long_opts, NULL)) != -1) {
 		int retval;
 
 		switch (opt) {
@@ -329,21 +491,7 @@ int main(int argc, char *argv[])
 				printf(PACKAGE_NAME " version " VERSION "\n");
 				break;
 			case 's':
-				img.size = atoi(optarg);
-				switch (optarg[strlen(optarg)-1]) {
-					case 'K':
-					case 'k':
-						img.size *= 1024;
-						break;
-					case 'M':
-					case 'm':
-						img.size *= 1024*1024;
-						break;
-					case 'G':
-					case 'g':
-						img.size *= 1024*1024*1024;
-						break;
-				}
+				img.size = parse_size(optarg);
 				printf("size img = %zd\n", img.size);
 				break;
 			case 'f':
@@ -351,13 +499,70 @@ int main(int argc, char *argv[])
 				break;
 			case 'w':
 			case 'r':
+			case 'F':
+			case 'B':
+			case 'U':
 				p = strchr(optarg, ',');
-				*p = '\0';
+				if (p == NULL && opt != 'F' && opt != 'B') {
+					fprintf(stderr, "Missing file for partition %s\n", optarg);
+					err++;
+					break;
+				}
+				if (p == NULL)
+					p = optarg + strlen(optarg);
+				else
+					*p++ = '\0';
 				act_tab[nb_act].part = strdup(optarg);
-				act_tab[nb_act].file = strdup(p+1);
+				act_tab[nb_act].file = strdup(p);
 				act_tab[nb_act].action = opt;
 				nb_act++;
 				break;
+			case 'S':
+				fault_seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'R':
+				fault_report = optarg;
+				break;
+			case 'j':
+				nb_threads = atoi(optarg);
+				if (nb_threads < 1) {
+					err++;
+					fprintf(stderr, "Wrong number of threads\n");
+				}
+				break;
+			case 'C':
+				convert_src = optarg;
+				break;
+			case 'L':
+				in_place = 1;
+				break;
+			case 'b':
+				block_size = parse_size(optarg);
+				break;
+			case 'm':
+				bbt_file = optarg;
+				break;
+			case 'k':
+				skip_bad = 1;
+				break;
+			case 'c':
+				cache_dir = strdup(optarg);
+				p = strchr(cache_dir, ',');
+				if (p) {
+					*p = '\0';
+					cache_max = parse_size(p+1);
+				}
+				break;
+			case 'X':
+				store_src = optarg;
+				break;
+			case 'A':
+				store_dst = optarg;
+				break;
+			case 'W':
+				watch_mode = 1;
+				in_place = 1;
+				break;
 			case 'p':
 				retval = partition_file(optarg);
 				if (retval != 0) err++;
@@ -373,79 +578,183 @@ int main(int argc, char *argv[])
 				break;
 			case 'z':
 				page_size = atoi(optarg);
-				for(i=0;i<3;i++) {
-					if (ecc_tab[i].page_size == page_size) {
-						ecc = &ecc_tab[i];
-						break;
-					}
-				}
-				if (ecc == NULL) {
-					err++;
-					fprintf(stderr, "Wrong page size\n");
-				}
+				break;
+			case 'e':
+				ecc_step = atoi(optarg);
+				break;
+			case 'E':
+				ecc_read = 1;
 				break;
 			default: /* '?' */
 				usage(argv[0]);
 				err++;
 		}
 	}
-	if (flash_type == FLASH_TYPE_NAND && ecc == NULL) {
-		fprintf(stderr, "Missing page size for NAND flash\n");
-		err++;
+	if (flash_type == FLASH_TYPE_NAND) {
+		ecc = ecc_find(page_size, ecc_step);
+		if (page_size == 0) {
+			fprintf(stderr, "Missing page size for NAND flash\n");
+			err++;
+		} else if (ecc == NULL) {
+			fprintf(stderr, "Wrong page size or ECC step\n");
+			err++;
+		}
 	}
 
-	if (!filename) {
+	if (!filename && !store_src) {
 		fprintf(stderr, "Mising image file\n");
 		err++;
 	}
 
-	if (err)
-		return EXIT_FAILURE;
+	if (block_size) {
+		if ((flash_type == FLASH_TYPE_NAND && ecc == NULL) ||
+		    block_size % page_size || block_size < 2 * page_size) {
+			fprintf(stderr, "Wrong erase block size\n");
+			err++;
+		}
+	} else if (bbt_file || skip_bad) {
+		fprintf(stderr, "Missing erase block size\n");
+		err++;
+	}
 
-	fd_img = open(filename, O_CREAT | O_RDONLY, 0666);
-	len = lseek(fd_img, 0, SEEK_END);
+	if ((bbt_file || skip_bad) && flash_type != FLASH_TYPE_NAND) {
+		fprintf(stderr, "Bad blocks are for NAND flash only\n");
+		err++;
+	}
 
-	if (img.size == 0)
-		img.size = len;
+	if (store_src && (in_place || convert_src)) {
+		fprintf(stderr, "Can't open an image of the store in place or convert it\n");
+		err++;
+	}
 
-	if (img.size == 0) {
-		fprintf(stderr, "Error: image file is zero\n");
-		return EXIT_FAILURE;
+	if (in_place && bbt_file) {
+		fprintf(stderr, "Can't mark bad blocks in place\n");
+		err++;
 	}
 
-	if (flash_type == FLASH_TYPE_NAND)
-		img.size += img.size / page_size * ecc->oob_size;
+	if (in_place && convert_src) {
+		fprintf(stderr, "Can't convert an image in place\n");
+		err++;
+	}
 
-	img.mem = malloc(img.size);
-	if (img.mem == NULL) {
-		fprintf(stderr, "Error: malloc\n");
+	if (convert_src && convert_open(convert_src))
+		err++;
+
+	if (err)
 		return EXIT_FAILURE;
-	}
+
+	if (img.size && flash_type == FLASH_TYPE_NAND)
+		img.size += img.size / page_size * ecc->oob_size;
 
 	printf("Flash type: %s\n", flash_type==FLASH_TYPE_NAND ? "NAND": "NOR");
-	memset(img.mem, 0xFF, img.size);
-	
-	if (len) {
-		printf("Read content file\n");
-		lseek(fd_img, 0, SEEK_SET);
-		read(fd_img, img.mem, img.size);
+
+	if (store_src) {
+		if (store_open(store_src, &img))
+			return EXIT_FAILURE;
+		fd_img = -1;
+		if (filename)
+			fd_img = open(filename, O_CREAT | O_TRUNC | O_RDWR, 0666);
+		if (bbt_file || skip_bad)
+			store_fetch_all();
+	} else if (in_place) {
+		fd_img = image_map(filename, &img, img.size);
+	} else {
+		fd_img = open(filename, O_CREAT | O_RDONLY, 0666);
+		len = lseek(fd_img, 0, SEEK_END);
+
+		if (img.size == 0 && convert_src) {
+			img.size = convert_size();
+			if (flash_type == FLASH_TYPE_NAND)
+				img.size += img.size / page_size * ecc->oob_size;
+		}
+
+		/* an existing image file already holds the OOB */
+		if (img.size == 0)
+			img.size = len;
+
+		if (img.size == 0) {
+			fprintf(stderr, "Error: image file is zero\n");
+			return EXIT_FAILURE;
+		}
+
+		img.mem = malloc(img.size);
+		if (img.mem == NULL) {
+			fprintf(stderr, "Error: malloc\n");
+			return EXIT_FAILURE;
+		}
+
+		memset(img.mem, 0xFF, img.size);
+
+		if (len) {
+			printf("Read content file\n");
+			lseek(fd_img, 0, SEEK_SET);
+			read(fd_img, img.mem, img.size);
+		}
+		close(fd_img);
+
+		/* truncated at the end only: a failed action keeps the file */
+		fd_img = open(filename, O_RDWR, 0666);
 	}
-	close(fd_img);
 
-	fd_img = open(filename, O_TRUNC | O_RDWR, 0666);
+	if (convert_src)
+		convert(&img);
+
+	if (bbt_file)
+		bbt_mark(&img, bbt_file);
+	if (skip_bad)
+		bbt_scan(&img);
 
 	for(i=0;i<nb_act;i++) {
 		putchar('\n');
-		if (act_tab[i].action == 'w')
-			partition_write(&img, act_tab[i].part, act_tab[i].file);
-		else
-			partition_read(&img, act_tab[i].part, act_tab[i].file);
+		if (in_place)
+			image_lock(fd_img, act_tab[i].part, act_tab[i].action != 'r' &&
+						act_tab[i].action != 'B');
+		if (store_src)
+			store_fetch(act_tab[i].part, act_tab[i].action == 'w');
+		switch (act_tab[i].action) {
+			case 'w':
+				partition_write(&img, act_tab[i].part, act_tab[i].file);
+				break;
+			case 'r':
+				if (partition_read(&img, act_tab[i].part,
+						   act_tab[i].file))
+					status = EXIT_FAILURE;
+				break;
+			case 'F':
+				fault_inject(&img, act_tab[i].part, act_tab[i].file);
+				break;
+			case 'B':
+				fault_bench(&img, act_tab[i].part, act_tab[i].file);
+				break;
+			case 'U':
+				ubi_write(&img, act_tab[i].part, act_tab[i].file);
+				break;
+		}
+		if (in_place)
+			image_unlock(fd_img, &img, act_tab[i].part);
 	}
 
-	write(fd_img, img.mem, img.size);
-	close(fd_img);
+	if (cache_dir)
+		cache_report();
+
+	if (watch_mode)
+		watch(fd_img, &img, act_tab, nb_act);
+
+	if (store_src && (fd_img >= 0 || store_dst))
+		store_fetch_all();
+	if (store_dst)
+		store_add(store_dst, &img);
+
+	if (in_place)
+		munmap(img.mem, img.size);
+	else if (fd_img >= 0) {
+		write(fd_img, img.mem, img.size);
+		ftruncate(fd_img, img.size);
+	}
+	if (fd_img >= 0)
+		close(fd_img);
 
 	free(filename);
 
-	return EXIT_SUCCESS;
+	return status;
 }
@@ -0,0 +1,486 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Content addressed page store. An image is stored as a manifest
+ * listing its erase blocks, data and OOB as found in the image file.
+ * Each block is stored once, in a chunk named after its hash:
+ *
+ * <store>/manifests/<name>
+ * <store>/chunks/<2 first hex digits>/<hash>[.<n>]
+ *
+ * The hash is not collision resistant: a chunk is only shared by
+ * blocks of the same content, a block colliding with stored chunks of
+ * another content gets the next free <n>. Erased blocks are not
+ * stored, they are '-' in the manifest.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+#define MANIFEST_MAGIC	"flashimg-manifest"
+#define MANIFEST_VERSION 1
+#define CHUNK_SEED0	0x5f0e7a1c
+#define CHUNK_SEED1	0xa3b1c4d9
+
+const char *store_src = NULL;
+const char *store_dst = NULL;
+
+struct chunk {
+	uint64_t hash[2];
+	int idx;		/* among the chunks of the same hash */
+	int erased;
+};
+
+struct store {
+	char dir[PATH_MAX / 2];
+	char name[NAME_MAX + 1];
+	struct image *img;
+	struct chunk *tab;
+	unsigned char *loaded;	/* blocks of the image already fetched */
+	long nb_block;
+	size_t block_raw;	/* bytes of a block in the image, OOB included */
+	long nb_new;
+	size_t written;
+	pthread_mutex_t lock;
+};
+
+static struct store src;
+
+static int store_parse(struct store *s, const char *spec)
+{
+	const char *p;
+
+	p = strchr(spec, ',');
+	if (p == NULL || p == spec || p[1] == '\0' || strchr(p + 1, '/') ||
+	    p - spec >= sizeof(s->dir) || strlen(p + 1) >= sizeof(s->name)) {
+		fprintf(stderr, "Error: wrong store %s, expect <store>,<name>\n",
+				spec);
+		return -1;
+	}
+	memcpy(s->dir, spec, p - spec);
+	s->dir[p - spec] = '\0';
+	strcpy(s->name, p + 1);
+
+	if (block_size == 0) {
+		fprintf(stderr, "Error: the page store needs the erase block size\n");
+		return -1;
+	}
+	s->block_raw = block_size / page_size * raw_page_size();
+
+	return 0;
+}
+
+static size_t chunk_len(struct store *s, long b)
+{
+	size_t off = b * s->block_raw;
+
+	if (s->img->size - off < s->block_raw)
+		return s->img->size - off;
+	return s->block_raw;
+}
+
+static void chunk_name(char *name, size_t len, struct chunk *c)
+{
+	int n;
+
+	n = snprintf(name, len, "%016llx%016llx",
+			(unsigned long long)c->hash[0],
+			(unsigned long long)c->hash[1]);
+	if (c->idx)
+		snprintf(name + n, len - n, ".%d", c->idx);
+}
+
+static void chunk_path(struct store *s, char *path, size_t len, struct chunk *c)
+{
+	char name[48];
+
+	chunk_name(name, sizeof(name), c);
+	snprintf(path, len, "%s/chunks/%02x/%s", s->dir,
+			(unsigned)(c->hash[0] >> 56), name);
+}
+
+static int chunk_check(struct chunk *c, const unsigned char *p, size_t len)
+{
+	return hash64(p, len, CHUNK_SEED0) == c->hash[0] &&
+		hash64(p, len, CHUNK_SEED1) == c->hash[1];
+}
+
+static void manifest_path(struct store *s, char *path, size_t len)
+{
+	snprintf(path, len, "%s/manifests/%s", s->dir, s->name);
+}
+
+/*
+ * Open a manifest of the store and allocate the image. The blocks
+ * are only fetched when an action needs them.
+ * spec: <store>,<name>
+ */
+int store_open(const char *spec, struct image *img)
+{
+	char path[PATH_MAX], line[128];
+	int version, type, ps, step;
+	long bs;
+	unsigned long long h0, h1;
+	size_t size;
+	long b;
+	FILE *fp;
+
+	if (store_parse(&src, spec))
+		return -1;
+
+	manifest_path(&src, path, sizeof(path));
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Can't open manifest %s\n", path);
+		return -1;
+	}
+
+	if (fscanf(fp, MANIFEST_MAGIC " %d %d %d %d %ld %zu\n", &version,
+			&type, &ps, &step, &bs, &size) != 6 ||
+	    version != MANIFEST_VERSION) {
+		fprintf(stderr, "Error: wrong manifest %s\n", path);
+		goto err;
+	}
+	if (type != flash_type || ps != page_size || bs != block_size ||
+	    (type == FLASH_TYPE_NAND && step != ecc->ecc_step)) {
+		fprintf(stderr, "Error: geometry of %s doesn't match\n", path);
+		goto err;
+	}
+
+	img->size = size;
+	src.img = img;
+	src.nb_block = (size + src.block_raw - 1) / src.block_raw;
+	src.tab = calloc(src.nb_block, sizeof(struct chunk));
+	src.loaded = calloc(src.nb_block, 1);
+	/* not erased: a block is fetched or erased before it is used */
+	img->mem = malloc(size);
+	if (src.tab == NULL || src.loaded == NULL || img->mem == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		goto err;
+	}
+
+	for (b=0;b<src.nb_block;b++) {
+		if (fgets(line, sizeof(line), fp) == NULL) {
+			fprintf(stderr, "Error: manifest %s truncated\n", path);
+			goto err;
+		}
+		if (line[0] == '-') {
+			src.tab[b].erased = 1;
+			continue;
+		}
+		if (sscanf(line, "%16llx%16llx", &h0, &h1) != 2 ||
+		    (line[32] == '.' && sscanf(line + 33, "%d",
+					       &src.tab[b].idx) != 1)) {
+			fprintf(stderr, "Error: wrong block %ld in %s\n", b, path);
+			goto err;
+		}
+		src.tab[b].hash[0] = h0;
+		src.tab[b].hash[1] = h1;
+	}
+	fclose(fp);
+
+	printf("Open %s from %s: %ld blocks\n", src.name, src.dir, src.nb_block);
+	return 0;
+
+err:
+	fclose(fp);
+	return -1;
+}
+
+struct fetch {
+	struct store *s;
+	long first;		/* first block of the range */
+};
+
+static void fetch_blocks(long first, long last, void *arg)
+{
+	struct fetch *f = arg;
+	struct store *s = f->s;
+	char path[PATH_MAX];
+	struct stat _stat;
+	unsigned char *p;
+	size_t len;
+	long b;
+	int fd;
+
+	for (b=f->first+first;b<f->first+last;b++) {
+		if (s->loaded[b])
+			continue;
+		len = chunk_len(s, b);
+		if (s->tab[b].erased) {
+			memset(s->img->mem + b * s->block_raw, 0xFF, len);
+			s->loaded[b] = 1;
+			continue;
+		}
+		chunk_path(s, path, sizeof(path), &s->tab[b]);
+		p = (unsigned char *)s->img->mem + b * s->block_raw;
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &_stat) || read(fd, p, len) != len) {
+			fprintf(stderr, "Error: can't read chunk %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		if (_stat.st_size != len || !chunk_check(&s->tab[b], p, len)) {
+			fprintf(stderr, "Error: chunk %s is corrupted\n", path);
+			exit(EXIT_FAILURE);
+		}
+		s->loaded[b] = 1;
+	}
+}
+
+/*
+ * Fetch the blocks holding a range of the image file. When the range
+ * is about to be erased, the blocks it covers entirely are erased
+ * instead of read, but on NAND where a bad block keeps its marker.
+ */
+static void store_fetch_range(size_t start, size_t len, int erase)
+{
+	struct fetch f;
+	long last, b;
+
+	if (start >= src.img->size || len == 0)
+		return;
+	if (start + len > src.img->size)
+		len = src.img->size - start;
+
+	f.s = &src;
+	f.first = start / src.block_raw;
+	last = (start + len + src.block_raw - 1) / src.block_raw;
+
+	if (erase && flash_type != FLASH_TYPE_NAND) {
+		for (b=f.first;b<last;b++) {
+			if (src.loaded[b] || b * src.block_raw < start ||
+			    b * src.block_raw + chunk_len(&src, b) > start + len)
+				continue;
+			memset(src.img->mem + b * src.block_raw, 0xFF,
+					chunk_len(&src, b));
+			src.loaded[b] = 1;
+		}
+	}
+
+	parallel_for(last - f.first, fetch_blocks, &f);
+}
+
+/*
+ * Fetch the blocks of a partition before an action
+ */
+void store_fetch(const char *part_name, int erase)
+{
+	struct partition *part;
+
+	part = partition_find(part_name);
+	if (part == NULL)
+		return;
+
+	store_fetch_range(phys_off(part->off),
+		(part->len + page_size - 1) / page_size * raw_page_size(), erase);
+}
+
+void store_fetch_all(void)
+{
+	store_fetch_range(0, src.img->size, 0);
+}
+
+static int store_mkdir(const char *dir, const char *sub)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+	if (mkdir(path, 0777) && access(path, W_OK)) {
+		fprintf(stderr, "Error: can't create %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int block_erased(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i=0;i<len;i++) {
+		if (p[i] != 0xFF)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Tell if a chunk holds the len bytes at p: 1 if it does, 0 if it
+ * holds another content, -1 if there is no such chunk
+ */
+static int chunk_same(const char *path, const unsigned char *p, size_t len,
+		      unsigned char *buf)
+{
+	struct stat _stat;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &_stat)) {
+		fprintf(stderr, "Error: can't read chunk %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	ret = _stat.st_size == len && read(fd, buf, len) == len &&
+		!memcmp(buf, p, len);
+	close(fd);
+
+	return ret;
+}
+
+static void add_blocks(long first, long last, void *arg)
+{
+	struct store *s = arg;
+	char path[PATH_MAX], tmp[PATH_MAX + 16], sub[8];
+	unsigned char *p, *buf;
+	long b, nb_new = 0;
+	size_t len, written = 0;
+	int fd, ret;
+
+	buf = malloc(s->block_raw);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (b=first;b<last;b++) {
+		struct chunk *c = &s->tab[b];
+
+		p = (unsigned char *)s->img->mem + b * s->block_raw;
+		len = chunk_len(s, b);
+		if (block_erased(p, len)) {
+			c->erased = 1;
+			continue;
+		}
+		c->hash[0] = hash64(p, len, CHUNK_SEED0);
+		c->hash[1] = hash64(p, len, CHUNK_SEED1);
+
+		c->idx = 0;
+		chunk_path(s, path, sizeof(path), c);
+		while ((ret = chunk_same(path, p, len, buf)) == 0) {
+			c->idx++;
+			chunk_path(s, path, sizeof(path), c);
+		}
+		if (ret > 0)
+			continue;
+
+		snprintf(sub, sizeof(sub), "%02x", (unsigned)(c->hash[0] >> 56));
+		snprintf(tmp, sizeof(tmp), "%s/chunks", s->dir);
+		if (store_mkdir(tmp, sub))
+			exit(EXIT_FAILURE);
+
+		/* a temporary file, so a chunk is never seen partial */
+		snprintf(tmp, sizeof(tmp), "%s.%d.%ld", path, getpid(), b);
+		fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+		if (fd < 0 || write(fd, p, len) != len) {
+			fprintf(stderr, "Error: can't write chunk %s\n", tmp);
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		if (rename(tmp, path)) {
+			fprintf(stderr, "Error: can't write chunk %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		nb_new++;
+		written += len;
+	}
+	free(buf);
+
+	pthread_mutex_lock(&s->lock);
+	s->nb_new += nb_new;
+	s->written += written;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Add the image to the store: only the blocks not already stored
+ * are written, then the manifest.
+ * spec: <store>,<name>
+ */
+void store_add(const char *spec, struct image *img)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16], name[48];
+	struct store s;
+	FILE *fp;
+	long b;
+
+	memset(&s, 0, sizeof(s));
+	if (store_parse(&s, spec))
+		exit(EXIT_FAILURE);
+	s.img = img;
+	s.nb_block = (img->size + s.block_raw - 1) / s.block_raw;
+	s.tab = calloc(s.nb_block, sizeof(struct chunk));
+	if (s.tab == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&s.lock, NULL);
+
+	if (mkdir(s.dir, 0777) && access(s.dir, W_OK)) {
+		fprintf(stderr, "Error: can't create %s\n", s.dir);
+		exit(EXIT_FAILURE);
+	}
+	if (store_mkdir(s.dir, "chunks") || store_mkdir(s.dir, "manifests"))
+		exit(EXIT_FAILURE);
+
+	parallel_for(s.nb_block, add_blocks, &s);
+
+	manifest_path(&s, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: can't write manifest %s\n", tmp);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(fp, MANIFEST_MAGIC " %d %d %d %d %ld %zu\n", MANIFEST_VERSION,
+			flash_type, page_size,
+			flash_type == FLASH_TYPE_NAND ? ecc->ecc_step : 0,
+			block_size, img->size);
+	for (b=0;b<s.nb_block;b++) {
+		if (s.tab[b].erased) {
+			fprintf(fp, "-\n");
+			continue;
+		}
+		chunk_name(name, sizeof(name), &s.tab[b]);
+		fprintf(fp, "%s\n", name);
+	}
+	if (fclose(fp) || rename(tmp, path)) {
+		fprintf(stderr, "Error: can't write manifest %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Add %s to %s: %ld blocks, %ld new, %zu bytes written\n",
+			s.name, s.dir, s.nb_block, s.nb_new, s.written);
+
+	pthread_mutex_destroy(&s.lock);
+	free(s.tab);
+}
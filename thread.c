@@ -0,0 +1,93 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+int nb_threads = 1;
+
+struct slice {
+	pthread_t thread;
+	long first;
+	long last;
+	void (*fn)(long first, long last, void *arg);
+	void *arg;
+};
+
+static void *slice_run(void *data)
+{
+	struct slice *s = data;
+
+	s->fn(s->first, s->last, s->arg);
+
+	return NULL;
+}
+
+/*
+ * Split [0, nb) in contiguous slices and run fn on each of them
+ * in its own thread. Each item is handled by exactly one thread,
+ * so fn does not need any locking as long as items do not overlap.
+ */
+void parallel_for(long nb, void (*fn)(long first, long last, void *arg),
+		  void *arg)
+{
+	struct slice *tab;
+	int i, nb_slice;
+	long chunk;
+
+	nb_slice = nb_threads;
+	if (nb_slice > nb)
+		nb_slice = nb;
+	if (nb_slice <= 1) {
+		if (nb > 0)
+			fn(0, nb, arg);
+		return;
+	}
+
+	tab = malloc(nb_slice * sizeof(*tab));
+	if (tab == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+
+	chunk = (nb + nb_slice - 1) / nb_slice;
+	for (i=0;i<nb_slice;i++) {
+		tab[i].first = i * chunk;
+		tab[i].last = tab[i].first + chunk;
+		if (tab[i].first > nb)
+			tab[i].first = nb;
+		if (tab[i].last > nb)
+			tab[i].last = nb;
+		tab[i].fn = fn;
+		tab[i].arg = arg;
+		if (pthread_create(&tab[i].thread, NULL, slice_run, &tab[i])) {
+			fprintf(stderr, "Error: can't create thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i=0;i<nb_slice;i++)
+		pthread_join(tab[i].thread, NULL);
+
+	free(tab);
+}
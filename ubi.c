@@ -0,0 +1,518 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * UBI image generation, see drivers/mtd/ubi/ubi-media.h for the
+ * on-flash format. All the fields are big endian.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+#define UBI_EC_HDR_MAGIC	0x55424923
+#define UBI_VID_HDR_MAGIC	0x55424921
+#define UBI_VERSION		1
+#define UBI_HDR_SIZE		64
+#define UBI_HDR_SIZE_CRC	60
+#define UBI_CRC32_INIT		0xFFFFFFFFU
+
+#define UBI_VID_DYNAMIC		1
+#define UBI_VID_STATIC		2
+#define UBI_COMPAT_REJECT	5
+
+#define UBI_LAYOUT_VOLUME_ID	0x7FFFEFFF
+#define UBI_LAYOUT_VOLUME_EBS	2
+#define UBI_MAX_VOLUMES		128
+#define UBI_VOL_NAME_MAX	127
+#define UBI_VTBL_RECORD_SIZE	172
+#define UBI_VTBL_RECORD_SIZE_CRC 168
+#define UBI_VTBL_AUTORESIZE_FLG	0x01
+
+/* PEBs the kernel keeps for wear leveling and atomic LEB change */
+#define UBI_WL_RESERVED_PEBS	1
+#define UBI_EBA_RESERVED_PEBS	1
+/* default bad PEB reserve, CONFIG_MTD_UBI_BEB_LIMIT */
+#define UBI_BEB_LIMIT		20
+
+struct ubi_vol {
+	char name[UBI_VOL_NAME_MAX + 1];
+	char *image;
+	int id;
+	int type;
+	int flags;
+	int alignment;
+	size_t size;		/* vol_size, 0 for the size of the image */
+	int data_pad;
+	int usable;		/* bytes of data per LEB */
+	long reserved;		/* reserved PEBs */
+	long used;		/* LEBs holding data */
+	long first_peb;		/* first PEB of the volume in the partition */
+	unsigned char *mem;
+	size_t len;
+};
+
+struct ubi {
+	struct image *img;
+	struct partition *part;
+	int vid_hdr_offs;
+	int data_offs;
+	int leb_size;
+	long nb_peb;
+	uint32_t image_seq;
+	unsigned char *vtbl;
+	int vtbl_slots;
+	int vtbl_size;
+	struct ubi_vol *vol;
+	int nb_vol;
+};
+
+static uint32_t crc_tab[256];
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i=0;i<256;i++) {
+		c = i;
+		for (j=0;j<8;j++)
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+		crc_tab[i] = c;
+	}
+}
+
+/*
+ * crc32 as used by UBI: little endian, no final inversion
+ */
+static uint32_t crc32(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = crc_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+static void put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+static void ec_hdr(struct ubi *u, unsigned char *p)
+{
+	memset(p, 0, UBI_HDR_SIZE);
+	put_be32(p, UBI_EC_HDR_MAGIC);
+	p[4] = UBI_VERSION;
+	put_be64(p + 8, 0);
+	put_be32(p + 16, u->vid_hdr_offs);
+	put_be32(p + 20, u->data_offs);
+	put_be32(p + 24, u->image_seq);
+	put_be32(p + 60, crc32(UBI_CRC32_INIT, p, UBI_HDR_SIZE_CRC));
+}
+
+static void vid_hdr(unsigned char *p, int type, int compat, uint32_t vol_id,
+		    uint32_t lnum, int data_pad, const unsigned char *data,
+		    uint32_t data_size, uint32_t used_ebs)
+{
+	memset(p, 0, UBI_HDR_SIZE);
+	put_be32(p, UBI_VID_HDR_MAGIC);
+	p[4] = UBI_VERSION;
+	p[5] = type;
+	p[7] = compat;
+	put_be32(p + 8, vol_id);
+	put_be32(p + 12, lnum);
+	put_be32(p + 28, data_pad);
+	if (type == UBI_VID_STATIC) {
+		put_be32(p + 20, data_size);
+		put_be32(p + 24, used_ebs);
+		put_be32(p + 32, crc32(UBI_CRC32_INIT, data, data_size));
+	}
+	put_be32(p + 60, crc32(UBI_CRC32_INIT, p, UBI_HDR_SIZE_CRC));
+}
+
+/*
+ * Parse the volume definitions, a subset of the ubinize ini file:
+ *
+ * [section]
+ * image=<file>
+ * vol_id=<id>
+ * vol_size=<size>
+ * vol_type=dynamic|static
+ * vol_name=<name>
+ * vol_flags=autoresize
+ * vol_alignment=<alignment>
+ */
+static int ubi_parse(struct ubi *u, const char *filename)
+{
+	char line[512], *key, *val, *p;
+	struct ubi_vol *v = NULL;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Can't open UBI volume file %s\n", filename);
+		return -1;
+	}
+
+	u->vol = calloc(UBI_MAX_VOLUMES, sizeof(struct ubi_vol));
+	u->nb_vol = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		for (key=line;isspace((unsigned char)*key);key++);
+		p = key + strlen(key);
+		while (p > key && isspace((unsigned char)p[-1]))
+			*--p = '\0';
+		if (*key == '\0' || *key == '#' || *key == ';')
+			continue;
+
+		if (*key == '[') {
+			if (u->nb_vol == UBI_MAX_VOLUMES) {
+				fprintf(stderr, "Error: too many UBI volumes\n");
+				goto err;
+			}
+			v = &u->vol[u->nb_vol];
+			v->id = u->nb_vol++;
+			v->type = UBI_VID_DYNAMIC;
+			v->alignment = 1;
+			p = strchr(key, ']');
+			if (p) *p = '\0';
+			snprintf(v->name, sizeof(v->name), "%s", key + 1);
+			continue;
+		}
+
+		val = strchr(key, '=');
+		if (v == NULL || val == NULL) {
+			fprintf(stderr, "Error in UBI volume file: %s\n", key);
+			goto err;
+		}
+		*val++ = '\0';
+		for (p=val-2;p>=key && isspace((unsigned char)*p);p--)
+			*p = '\0';
+		while (isspace((unsigned char)*val))
+			val++;
+
+		if (!strcmp(key, "image"))
+			v->image = strdup(val);
+		else if (!strcmp(key, "vol_id"))
+			v->id = atoi(val);
+		else if (!strcmp(key, "vol_size"))
+			v->size = parse_size(val);
+		else if (!strcmp(key, "vol_type"))
+			v->type = strcmp(val, "static") ? UBI_VID_DYNAMIC : UBI_VID_STATIC;
+		else if (!strcmp(key, "vol_name"))
+			snprintf(v->name, sizeof(v->name), "%s", val);
+		else if (!strcmp(key, "vol_flags"))
+			v->flags = strcmp(val, "autoresize") ? 0 : UBI_VTBL_AUTORESIZE_FLG;
+		else if (!strcmp(key, "vol_alignment"))
+			v->alignment = atoi(val);
+		else if (strcmp(key, "mode"))
+			fprintf(stderr, "Warning: unknown UBI key %s\n", key);
+	}
+
+	fclose(fp);
+	return 0;
+
+err:
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * Map the volume images and compute the LEBs of each volume
+ */
+static int ubi_volumes(struct ubi *u)
+{
+	struct ubi_vol *v;
+	struct stat _stat;
+	long peb = UBI_LAYOUT_VOLUME_EBS, reserved = UBI_LAYOUT_VOLUME_EBS;
+	long beb;
+	int i, j, fd, min_io, autoresize = 0;
+
+	/* smallest write: a page on NAND, a byte on NOR */
+	min_io = flash_type == FLASH_TYPE_NAND ? page_size : 1;
+
+	for (i=0;i<u->nb_vol;i++) {
+		v = &u->vol[i];
+
+		if (v->id < 0 || v->id >= u->vtbl_slots) {
+			fprintf(stderr, "Error: wrong UBI volume id %d\n", v->id);
+			return -1;
+		}
+		for (j=0;j<i;j++) {
+			if (u->vol[j].id == v->id) {
+				fprintf(stderr, "Error: UBI volume id %d used twice\n", v->id);
+				return -1;
+			}
+		}
+		if (v->alignment < 1 || v->alignment > u->leb_size ||
+		    (v->alignment != 1 && v->alignment % min_io)) {
+			fprintf(stderr, "Error: wrong alignment of UBI volume %s\n", v->name);
+			return -1;
+		}
+		if ((v->flags & UBI_VTBL_AUTORESIZE_FLG) && autoresize++) {
+			fprintf(stderr, "Error: more than one auto-resize UBI volume\n");
+			return -1;
+		}
+
+		if (v->image) {
+			fd = open(v->image, O_RDONLY);
+			if (fd < 0 || fstat(fd, &_stat)) {
+				fprintf(stderr, "Can't open UBI volume image %s\n", v->image);
+				return -1;
+			}
+			v->len = _stat.st_size;
+			if (v->len) {
+				v->mem = mmap(NULL, v->len, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (v->mem == MAP_FAILED) {
+					fprintf(stderr, "Error: can't map %s\n", v->image);
+					close(fd);
+					return -1;
+				}
+			}
+			close(fd);
+		}
+
+		if (v->size == 0)
+			v->size = v->len;
+		if (v->size < v->len) {
+			fprintf(stderr, "Error: image %s bigger than UBI volume %s\n",
+					v->image, v->name);
+			return -1;
+		}
+
+		v->data_pad = u->leb_size % v->alignment;
+		v->usable = u->leb_size - v->data_pad;
+		v->used = (v->len + v->usable - 1) / v->usable;
+		v->reserved = (v->size + v->usable - 1) / v->usable;
+		if (v->reserved == 0)
+			v->reserved = 1;
+		v->first_peb = peb;
+		peb += v->used;
+		reserved += v->reserved;
+
+		printf("UBI volume %d %s: %ld LEBs used, %ld reserved\n",
+				v->id, v->name, v->used, v->reserved);
+	}
+
+	reserved += UBI_WL_RESERVED_PEBS + UBI_EBA_RESERVED_PEBS;
+	if (reserved > u->nb_peb) {
+		fprintf(stderr, "Error: UBI volumes need %ld PEBs, partition %s has %ld\n",
+				reserved, u->part->name, u->nb_peb);
+		return -1;
+	}
+
+	/* the kernel rounds the bad PEB reserve up */
+	beb = (u->nb_peb * UBI_BEB_LIMIT + 1023) / 1024;
+	if (flash_type == FLASH_TYPE_NAND && reserved + beb > u->nb_peb)
+		fprintf(stderr, "Warning: no room left in partition %s for the "
+				"%ld PEBs of the bad PEB reserve\n",
+				u->part->name, beb);
+
+	return 0;
+}
+
+static void ubi_vtbl(struct ubi *u)
+{
+	struct ubi_vol *v;
+	unsigned char *rec;
+	int i, slots;
+
+	slots = u->vtbl_slots;
+	u->vtbl_size = slots * UBI_VTBL_RECORD_SIZE;
+	u->vtbl = calloc(1, u->vtbl_size);
+
+	for (i=0;i<u->nb_vol;i++) {
+		v = &u->vol[i];
+		rec = u->vtbl + v->id * UBI_VTBL_RECORD_SIZE;
+		put_be32(rec, v->reserved);
+		put_be32(rec + 4, v->alignment);
+		put_be32(rec + 8, v->data_pad);
+		rec[12] = v->type;
+		put_be16(rec + 14, strlen(v->name));
+		memcpy(rec + 16, v->name, strlen(v->name));
+		rec[144] = v->flags;
+	}
+
+	for (i=0;i<slots;i++) {
+		rec = u->vtbl + i * UBI_VTBL_RECORD_SIZE;
+		put_be32(rec + UBI_VTBL_RECORD_SIZE_CRC,
+			 crc32(UBI_CRC32_INIT, rec, UBI_VTBL_RECORD_SIZE_CRC));
+	}
+
+	u->image_seq = crc32(UBI_CRC32_INIT, u->vtbl, u->vtbl_size);
+}
+
+/*
+ * Build the content of a PEB in buf
+ */
+static void ubi_peb(struct ubi *u, long peb, unsigned char *buf)
+{
+	unsigned char *data = buf + u->data_offs;
+	struct ubi_vol *v = NULL;
+	size_t off, len;
+	long lnum;
+	int i;
+
+	memset(buf, 0xFF, block_size);
+	ec_hdr(u, buf);
+
+	if (peb < UBI_LAYOUT_VOLUME_EBS) {
+		vid_hdr(buf + u->vid_hdr_offs, UBI_VID_DYNAMIC, UBI_COMPAT_REJECT,
+			UBI_LAYOUT_VOLUME_ID, peb, 0, NULL, 0, 0);
+		memcpy(data, u->vtbl, u->vtbl_size);
+		return;
+	}
+
+	for (i=0;i<u->nb_vol;i++) {
+		if (peb >= u->vol[i].first_peb &&
+		    peb < u->vol[i].first_peb + u->vol[i].used) {
+			v = &u->vol[i];
+			break;
+		}
+	}
+	if (v == NULL)
+		return;		/* free PEB */
+
+	lnum = peb - v->first_peb;
+	off = lnum * v->usable;
+	len = v->len - off;
+	if (len > v->usable)
+		len = v->usable;
+	memcpy(data, v->mem + off, len);
+	vid_hdr(buf + u->vid_hdr_offs, v->type, 0, v->id, lnum, v->data_pad,
+		data, len, v->used);
+}
+
+static void ubi_pebs(long first, long last, void *arg)
+{
+	struct ubi *u = arg;
+	unsigned char *buf, *p;
+	long peb, ppb = block_size / page_size;
+	int i;
+
+	buf = malloc(block_size);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (peb=first;peb<last;peb++) {
+		ubi_peb(u, peb, buf);
+		for (i=0;i<ppb;i++) {
+			p = (unsigned char *)u->img->mem +
+				part_page_off(u->part, peb * ppb + i);
+			memcpy(p, buf + i * page_size, page_size);
+			if (flash_type == FLASH_TYPE_NAND)
+				oob(p, page_size, p + page_size);
+		}
+	}
+
+	free(buf);
+}
+
+/*
+ * Write an UBI image made of the volumes defined in a file to a
+ * partition. Every PEB of the partition gets an EC header, the PEBs
+ * are built independently on the thread pool.
+ */
+void ubi_write(struct image *img, const char *part_name, const char *filename)
+{
+	struct ubi u;
+	int i;
+
+	memset(&u, 0, sizeof(u));
+	u.img = img;
+	u.part = partition_find(part_name);
+	if (u.part == NULL) {
+		fprintf(stderr, "Error: unknown partition %s\n", part_name);
+		exit(EXIT_FAILURE);
+	}
+	if (block_size == 0) {
+		fprintf(stderr, "Error: UBI needs the erase block size\n");
+		exit(EXIT_FAILURE);
+	}
+	if (u.part->off % block_size || u.part->len % block_size) {
+		fprintf(stderr, "Error: partition %s not aligned on erase blocks\n",
+				part_name);
+		exit(EXIT_FAILURE);
+	}
+	if (phys_off(u.part->off + u.part->len) > img->size) {
+		fprintf(stderr, "Error: image file too small\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* no sub-pages: the headers take a page each on NAND */
+	if (flash_type == FLASH_TYPE_NAND) {
+		u.vid_hdr_offs = page_size;
+		u.data_offs = 2 * page_size;
+	} else {
+		u.vid_hdr_offs = UBI_HDR_SIZE;
+		u.data_offs = 2 * UBI_HDR_SIZE;
+	}
+	u.leb_size = block_size - u.data_offs;
+	u.nb_peb = part_nb_page(u.part) / (block_size / page_size);
+	u.vtbl_slots = u.leb_size / UBI_VTBL_RECORD_SIZE;
+	if (u.vtbl_slots > UBI_MAX_VOLUMES)
+		u.vtbl_slots = UBI_MAX_VOLUMES;
+
+	printf("UBI in partition %s: %ld PEBs, LEB size %d\n",
+			part_name, u.nb_peb, u.leb_size);
+
+	if (bbt_check(img, u.part, part_nb_page(u.part)))
+		exit(EXIT_FAILURE);
+
+	crc32_init();
+	if (ubi_parse(&u, filename) || ubi_volumes(&u))
+		exit(EXIT_FAILURE);
+	ubi_vtbl(&u);
+
+	parallel_for(u.nb_peb, ubi_pebs, &u);
+
+	for (i=0;i<u.nb_vol;i++) {
+		if (u.vol[i].len)
+			munmap(u.vol[i].mem, u.vol[i].len);
+		free(u.vol[i].image);
+	}
+	free(u.vol);
+	free(u.vtbl);
+}
@@ -0,0 +1,205 @@
+/*
+ * flashimg
+ * Copyright (C) 2011-2012  Yargil <yargil@free.fr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include "config.h"
+#include "flashimg.h"
+
+struct watch {
+	int wd;
+	char *dir;
+	char *base;
+	struct action *act;
+};
+
+static int page_erased(const unsigned char *p, int len)
+{
+	int i;
+
+	for (i=0;i<len;i++) {
+		if (p[i] != 0xFF)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Rewrite a partition in place: only the pages whose content changed
+ * are copied and get a new OOB, the pages after the end of the file
+ * are erased but the bad blocks.
+ */
+static int partition_update(struct image *img, const char *part_name,
+			    const char *filename)
+{
+	struct partition *part;
+	unsigned char *buf, *p;
+	long n, pages, changed = 0;
+	size_t len;
+	FILE *fp;
+	int raw;
+
+	part = partition_find(part_name);
+	if (part == NULL)
+		return -1;
+
+	pages = part_nb_page(part);
+	raw = raw_page_size();
+	if (phys_off(part->off) + (part->len + page_size - 1) / page_size * raw
+			> img->size) {
+		fprintf(stderr, "Error: partition too big\n");
+		return -1;
+	}
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: can't open file %s\n", filename);
+		return -1;
+	}
+	buf = malloc(pages * page_size + 1);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+	len = fread(buf, 1, pages * page_size + 1, fp);
+	fclose(fp);
+	if (len > pages * page_size) {
+		fprintf(stderr, "File %s to big for the partition %s\n",
+				filename, part_name);
+		free(buf);
+		return -1;
+	}
+	memset(buf + len, 0xFF, pages * page_size - len);
+	if (bbt_check(img, part, (len + page_size - 1) / page_size)) {
+		free(buf);
+		return -1;
+	}
+
+	for (n=0;n<pages;n++) {
+		p = (unsigned char *)img->mem + part_page_off(part, n);
+		if (n * page_size >= len) {
+			if (page_erased(p, raw) || part_page_bad(img, part, n))
+				continue;
+			memset(p, 0xFF, raw);
+		} else {
+			if (!memcmp(p, buf + n * page_size, page_size))
+				continue;
+			memcpy(p, buf + n * page_size, page_size);
+			if (flash_type == FLASH_TYPE_NAND)
+				oob(p, page_size, p + page_size);
+		}
+		changed++;
+	}
+	printf("Update %s: %ld of %ld pages changed\n", part_name, changed, pages);
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * Watch the files written with -w and update their partition each
+ * time they are rewritten. The directories are watched, not the
+ * files, to see the files replaced by a rename.
+ */
+void watch(int fd_img, struct image *img, struct action *act_tab, int nb_act)
+{
+	struct watch *tab;
+	struct timespec start, end;
+	char buf[4096], *p;
+	int fd, i, nb = 0;
+	ssize_t len;
+
+	fd = inotify_init();
+	if (fd < 0) {
+		perror("Error: inotify");
+		exit(EXIT_FAILURE);
+	}
+
+	tab = calloc(nb_act, sizeof(*tab));
+	if (tab == NULL) {
+		fprintf(stderr, "Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i=0;i<nb_act;i++) {
+		if (act_tab[i].action != 'w')
+			continue;
+		tab[nb].act = &act_tab[i];
+		tab[nb].dir = strdup(act_tab[i].file);
+		p = strrchr(tab[nb].dir, '/');
+		if (p == NULL) {
+			free(tab[nb].dir);
+			tab[nb].dir = strdup(".");
+			tab[nb].base = act_tab[i].file;
+		} else {
+			*p = '\0';
+			tab[nb].base = p + 1;
+			if (p == tab[nb].dir)
+				strcpy(tab[nb].dir, "/");
+		}
+		tab[nb].wd = inotify_add_watch(fd, tab[nb].dir,
+				IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (tab[nb].wd < 0) {
+			fprintf(stderr, "Error: can't watch %s\n", tab[nb].dir);
+			exit(EXIT_FAILURE);
+		}
+		printf("Watch %s for partition %s\n", act_tab[i].file,
+				act_tab[i].part);
+		nb++;
+	}
+	if (nb == 0) {
+		fprintf(stderr, "Error: nothing to watch\n");
+		exit(EXIT_FAILURE);
+	}
+	fflush(stdout);
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p=buf;p<buf+len;) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			p += sizeof(*ev) + ev->len;
+			if (ev->len == 0)
+				continue;
+
+			for (i=0;i<nb;i++) {
+				if (tab[i].wd != ev->wd || strcmp(tab[i].base, ev->name))
+					continue;
+
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				image_lock(fd_img, tab[i].act->part, 1);
+				partition_update(img, tab[i].act->part, tab[i].act->file);
+				image_unlock(fd_img, img, tab[i].act->part);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				printf("Done in %.3f ms\n",
+					(end.tv_sec - start.tv_sec) * 1e3 +
+					(end.tv_nsec - start.tv_nsec) / 1e6);
+				fflush(stdout);
+			}
+		}
+	}
+
+	perror("Error: inotify");
+	exit(EXIT_FAILURE);
+}